@@ -0,0 +1,581 @@
+#include "streamdeckpp.hh"
+
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <new>
+#include <print>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <poll.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+using namespace std::string_literals;
+
+namespace streamdeck {
+
+  namespace {
+
+    constexpr uint32_t shm_magic = 0x5344424b;
+    constexpr uint64_t input_ring_size = 64;
+    constexpr size_t frame_align = 64;
+
+    static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free, "atomics in shared memory must be lock-free");
+
+    // Layout of the shared memory of a device.  The framebuffers of the keys follow the header,
+    // starting at frame_offset, each frame_size bytes long.  Every client can write all of the
+    // memory.  The broker therefore uses only its own copy of the geometry and never trusts
+    // values read from here.
+    struct shm_header {
+      uint32_t magic;
+      uint32_t key_count;
+      uint32_t pixel_width;
+      uint32_t pixel_height;
+      uint64_t frame_offset;
+      uint64_t frame_size;
+
+      // Keys with committed images.  Clients increment dirty_wake and wake the broker.
+      std::atomic<uint64_t> dirty;
+      std::atomic<uint32_t> dirty_wake;
+
+      // Keys whose images are being uploaded.  The broker increments upload_wake after each upload
+      // so that clients waiting to draw the next image of a key wake up.
+      std::atomic<uint64_t> busy;
+      std::atomic<uint32_t> upload_wake;
+
+      // Ring buffer of key states, written only by the broker.  A slot is valid if its sequence
+      // number is one more than its position.
+      std::atomic<uint32_t> input_wake;
+      std::atomic<uint64_t> input_head;
+      struct {
+        std::atomic<uint64_t> seq;
+        std::atomic<uint64_t> keys;
+      } input[input_ring_size];
+    };
+
+    struct claim_request {
+      char serial[64];
+      uint64_t keys;
+    };
+
+    struct claim_reply {
+      int32_t status;
+      uint32_t key_count;
+      uint32_t pixel_width;
+      uint32_t pixel_height;
+      uint64_t size;
+    };
+
+    enum : int32_t {
+      claim_ok = 0,
+      claim_unknown_device = -1,
+      claim_invalid_keys = -2,
+      claim_keys_taken = -3,
+    };
+
+
+    // The futex words are in memory shared between processes, therefore the private futex
+    // operations used by std::atomic::wait cannot be used.
+    void futex_wait(std::atomic<uint32_t>& word, uint32_t val, int timeout)
+    {
+      timespec ts{timeout / 1000, (timeout % 1000) * 1000000L};
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, val, timeout < 0 ? nullptr : &ts, nullptr, 0);
+    }
+
+    void futex_wake(std::atomic<uint32_t>& word)
+    {
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+
+    sockaddr_un make_address(const std::string& path)
+    {
+      sockaddr_un sun{};
+      if (path.size() >= sizeof(sun.sun_path))
+        throw std::runtime_error("socket path too long: "s + path);
+      sun.sun_family = AF_UNIX;
+      path.copy(sun.sun_path, path.size());
+      return sun;
+    }
+
+
+    [[noreturn]] void throw_errno(const char* msg, int fd = -1)
+    {
+      auto err = errno;
+      if (fd != -1)
+        close(fd);
+      throw std::runtime_error(msg + ": "s + strerror(err));
+    }
+
+
+    bool send_reply(int fd, const claim_reply& rep, int memfd)
+    {
+      iovec iov{const_cast<claim_reply*>(&rep), sizeof(rep)};
+      msghdr msg{};
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+
+      alignas(cmsghdr) char buf[CMSG_SPACE(sizeof(int))];
+      if (memfd != -1) {
+        msg.msg_control = buf;
+        msg.msg_controllen = sizeof(buf);
+        auto cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+      }
+
+      return sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(rep);
+    }
+
+
+    uint64_t all_keys(unsigned key_count)
+    {
+      return key_count >= 64 ? ~uint64_t(0) : (uint64_t(1) << key_count) - 1;
+    }
+
+  } // anonymous namespace
+
+
+  struct broker::deck {
+    deck(device_type& dev_, std::atomic<bool>& done_);
+    ~deck();
+
+    void uploader();
+    void reader();
+
+    device_type& dev;
+    std::atomic<bool>& done;
+    const std::string serial;
+    int memfd = -1;
+    size_t frame_offset = 0;
+    size_t frame_size = 0;
+    size_t size = 0;
+    shm_header* shm = nullptr;
+    uint64_t input_head = 0;
+    std::atomic<uint64_t> owned = 0;
+    std::thread upload_thread;
+    std::thread read_thread;
+  };
+
+
+  broker::deck::deck(device_type& dev_, std::atomic<bool>& done_) : dev(dev_), done(done_), serial(dev.get_serial_number())
+  {
+    if (dev.key_count > 64)
+      throw std::runtime_error("too many keys");
+
+    frame_offset = (sizeof(shm_header) + frame_align - 1) & ~(frame_align - 1);
+    frame_size = (size_t(dev.pixel_width) * dev.pixel_height * 4 + frame_align - 1) & ~(frame_align - 1);
+    size = frame_offset + dev.key_count * frame_size;
+
+    memfd = memfd_create(("streamdeck-"s + serial).c_str(), MFD_CLOEXEC);
+    if (memfd == -1)
+      throw_errno("cannot create shared memory");
+    if (ftruncate(memfd, size) != 0)
+      throw_errno("cannot size shared memory", memfd);
+    auto mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (mem == MAP_FAILED)
+      throw_errno("cannot map shared memory", memfd);
+
+    shm = new (mem) shm_header{};
+    shm->key_count = dev.key_count;
+    shm->pixel_width = dev.pixel_width;
+    shm->pixel_height = dev.pixel_height;
+    shm->frame_offset = frame_offset;
+    shm->frame_size = frame_size;
+    shm->magic = shm_magic;
+  }
+
+
+  broker::deck::~deck()
+  {
+    if (upload_thread.joinable())
+      upload_thread.join();
+    if (read_thread.joinable())
+      read_thread.join();
+    munmap(shm, size);
+    close(memfd);
+  }
+
+
+  // Upload all committed images of owned keys.  The images committed while an upload is in
+  // progress are handled together in the next round.  A key is marked busy before its dirty bit
+  // is cleared so that clients always see one of the two bits until the upload is done.
+  void broker::deck::uploader()
+  {
+    auto frames = reinterpret_cast<const std::byte*>(shm) + frame_offset;
+
+    while (! done) {
+      auto w = shm->dirty_wake.load();
+      auto pending = shm->dirty.load();
+      if (pending == 0) {
+        futex_wait(shm->dirty_wake, w, 100);
+        continue;
+      }
+      auto keys = pending & owned & all_keys(dev.key_count);
+      shm->busy.fetch_or(keys);
+      shm->dirty.fetch_and(~pending);
+
+      for (; keys != 0; keys &= keys - 1) {
+        unsigned key = std::countr_zero(keys);
+        try {
+          dev.set_key_image(key, std::span(frames + key * frame_size, size_t(dev.pixel_width) * dev.pixel_height * 4), dev.pixel_width, dev.pixel_height, dev.pixel_width * 4, device_type::pixel_format::bgra);
+        }
+        catch (const std::exception& e) {
+          std::println("cannot upload image for key {}: {}", key, e.what());
+        }
+
+        shm->busy.fetch_and(~(uint64_t(1) << key));
+        shm->upload_wake.fetch_add(1);
+        futex_wake(shm->upload_wake);
+      }
+    }
+  }
+
+
+  void broker::deck::reader()
+  {
+    while (! done) {
+      std::optional<std::vector<bool>> ss;
+      try {
+        ss = dev.read(100);
+      }
+      catch (const std::exception& e) {
+        // Most likely the device was unplugged.  Clients see no further input.
+        std::println("cannot read from {}: {}", serial, e.what());
+        break;
+      }
+      if (ss) {
+        uint64_t keys = 0;
+        for (size_t i = 0; i < ss->size(); ++i)
+          if ((*ss)[i])
+            keys |= uint64_t(1) << i;
+
+        auto head = input_head++;
+        auto& slot = shm->input[head % input_ring_size];
+        slot.seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.keys.store(keys, std::memory_order_relaxed);
+        slot.seq.store(head + 1, std::memory_order_release);
+        shm->input_head.store(head + 1, std::memory_order_release);
+
+        shm->input_wake.fetch_add(1, std::memory_order_release);
+        futex_wake(shm->input_wake);
+      }
+    }
+  }
+
+
+  broker::broker(context& ctx, const char* path) : m_path(path)
+  {
+    auto sun = make_address(m_path);
+
+    // Do not take over the socket of a running broker.
+    m_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_fd == -1)
+      throw_errno("cannot create socket");
+    if (connect(m_fd, reinterpret_cast<sockaddr*>(&sun), sizeof(sun)) == 0) {
+      close(m_fd);
+      throw std::runtime_error("broker already running on "s + m_path);
+    }
+    close(m_fd);
+    m_fd = -1;
+
+    for (auto& dev : ctx)
+      if (dev->connected())
+        m_decks.emplace_back(std::make_unique<deck>(*dev, m_done));
+    if (m_decks.empty())
+      throw std::runtime_error("no device available");
+
+    m_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_fd == -1)
+      throw_errno("cannot create socket");
+    unlink(m_path.c_str());
+    auto oldmask = umask(0077);
+    auto r = bind(m_fd, reinterpret_cast<sockaddr*>(&sun), sizeof(sun));
+    umask(oldmask);
+    if (r != 0 || listen(m_fd, SOMAXCONN) != 0)
+      throw_errno("cannot listen on broker socket", m_fd);
+    m_stopfd = eventfd(0, EFD_CLOEXEC);
+    if (m_stopfd == -1)
+      throw_errno("cannot create eventfd", m_fd);
+
+    for (auto& d : m_decks) {
+      d->upload_thread = std::thread(&deck::uploader, d.get());
+      d->read_thread = std::thread(&deck::reader, d.get());
+    }
+  }
+
+
+  broker::~broker()
+  {
+    m_done = true;
+    m_decks.clear();
+    close(m_stopfd);
+    close(m_fd);
+    unlink(m_path.c_str());
+  }
+
+
+  std::string broker::default_path()
+  {
+    if (auto s = getenv("STREAMDECK_BROKER"); s != nullptr && *s != '\0')
+      return s;
+    if (auto s = getenv("XDG_RUNTIME_DIR"); s != nullptr && *s != '\0')
+      return s + "/streamdeck-broker.sock"s;
+    return "/tmp/streamdeck-broker-"s + std::to_string(getuid()) + ".sock";
+  }
+
+
+  void broker::release(size_t d, uint64_t keys)
+  {
+    m_decks[d]->owned &= ~keys;
+  }
+
+
+  void broker::run()
+  {
+    struct client {
+      int fd;
+      std::vector<std::pair<size_t, uint64_t>> claims;
+    };
+    std::vector<client> clients;
+
+    while (! m_done) {
+      std::vector<pollfd> fds{{m_fd, POLLIN, 0}, {m_stopfd, POLLIN, 0}};
+      for (auto& c : clients)
+        fds.push_back({c.fd, POLLIN, 0});
+      if (poll(fds.data(), fds.size(), -1) < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      if (fds[1].revents != 0)
+        break;
+
+      for (size_t i = clients.size(); i-- > 0;) {
+        if (fds[2 + i].revents == 0)
+          continue;
+
+        auto& c = clients[i];
+        claim_request req;
+        if (recv(c.fd, &req, sizeof(req), MSG_WAITALL) != sizeof(req)) {
+          for (auto [d, keys] : c.claims)
+            release(d, keys);
+          close(c.fd);
+          clients.erase(clients.begin() + i);
+          continue;
+        }
+        req.serial[sizeof(req.serial) - 1] = '\0';
+
+        size_t d = 0;
+        while (d < m_decks.size() && req.serial[0] != '\0' && m_decks[d]->serial != req.serial)
+          ++d;
+
+        claim_reply rep{};
+        int memfd = -1;
+        if (d == m_decks.size())
+          rep.status = claim_unknown_device;
+        else if (auto& dk = *m_decks[d]; req.keys == 0 || (req.keys & ~all_keys(dk.dev.key_count)) != 0)
+          rep.status = claim_invalid_keys;
+        else if ((dk.owned & req.keys) != 0)
+          rep.status = claim_keys_taken;
+        else {
+          dk.owned |= req.keys;
+          c.claims.emplace_back(d, req.keys);
+          rep = claim_reply{claim_ok, dk.dev.key_count, dk.dev.pixel_width, dk.dev.pixel_height, dk.size};
+          memfd = dk.memfd;
+        }
+        send_reply(c.fd, rep, memfd);
+      }
+
+      if ((fds[0].revents & POLLIN) != 0)
+        if (int fd = accept4(m_fd, nullptr, nullptr, SOCK_CLOEXEC); fd != -1) {
+          // A client sending an incomplete request must not block the broker.  The connection
+          // is dropped after the timeout.
+          timeval tv{1, 0};
+          setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+          clients.emplace_back(fd);
+        }
+    }
+
+    for (auto& c : clients) {
+      for (auto [d, keys] : c.claims)
+        release(d, keys);
+      close(c.fd);
+    }
+  }
+
+
+  void broker::stop()
+  {
+    m_done = true;
+    uint64_t one = 1;
+    if (::write(m_stopfd, &one, sizeof(one)) != sizeof(one))
+      std::println("cannot stop broker: {}", strerror(errno));
+  }
+
+
+  broker_client::broker_client(const char* path, const std::string& serial, uint64_t keys) : m_keys(keys)
+  {
+    auto sun = make_address(path);
+    m_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_fd == -1)
+      throw_errno("cannot create socket");
+    if (connect(m_fd, reinterpret_cast<sockaddr*>(&sun), sizeof(sun)) != 0)
+      throw_errno("cannot connect to broker", m_fd);
+
+    claim_request req{};
+    serial.copy(req.serial, sizeof(req.serial) - 1);
+    req.keys = keys;
+    if (send(m_fd, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req))
+      throw_errno("cannot send claim", m_fd);
+
+    claim_reply rep;
+    iovec iov{&rep, sizeof(rep)};
+    alignas(cmsghdr) char buf[CMSG_SPACE(sizeof(int))];
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = sizeof(buf);
+    if (recvmsg(m_fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(rep))
+      throw_errno("no reply from broker", m_fd);
+
+    int memfd = -1;
+    if (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+
+    if (rep.status != claim_ok || memfd == -1) {
+      close(m_fd);
+      if (memfd != -1)
+        close(memfd);
+      switch (rep.status) {
+      case claim_unknown_device:
+        throw std::runtime_error("unknown device "s + serial);
+      case claim_invalid_keys:
+        throw std::runtime_error("invalid keys");
+      case claim_keys_taken:
+        throw std::runtime_error("keys already claimed");
+      default:
+        throw std::runtime_error("claim failed");
+      }
+    }
+
+    m_mem = mmap(nullptr, rep.size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    close(memfd);
+    if (m_mem == MAP_FAILED)
+      throw_errno("cannot map shared memory", m_fd);
+    m_size = rep.size;
+
+    auto shm = static_cast<shm_header*>(m_mem);
+    if (shm->magic != shm_magic) {
+      munmap(m_mem, m_size);
+      close(m_fd);
+      throw std::runtime_error("invalid shared memory");
+    }
+    m_key_count = shm->key_count;
+    m_pixel_width = shm->pixel_width;
+    m_pixel_height = shm->pixel_height;
+    m_tail = shm->input_head.load(std::memory_order_acquire);
+  }
+
+
+  broker_client::~broker_client()
+  {
+    munmap(m_mem, m_size);
+    close(m_fd);
+  }
+
+
+  std::span<std::byte> broker_client::framebuffer(unsigned key)
+  {
+    auto bit = uint64_t(1) << key;
+    if (key >= m_key_count || (m_keys & bit) == 0)
+      return {};
+
+    // Wait until the last committed image of the key is uploaded, otherwise the new image
+    // would be drawn into the memory the broker is reading.  Stop waiting if the broker is gone.
+    auto shm = static_cast<shm_header*>(m_mem);
+    while (true) {
+      auto w = shm->upload_wake.load();
+      if (((shm->dirty.load() | shm->busy.load()) & bit) == 0)
+        break;
+      futex_wait(shm->upload_wake, w, 100);
+
+      pollfd pfd{m_fd, POLLIN, 0};
+      if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR | POLLIN)) != 0)
+        break;
+    }
+
+    return std::span(static_cast<std::byte*>(m_mem) + shm->frame_offset + key * shm->frame_size, size_t(m_pixel_width) * m_pixel_height * 4);
+  }
+
+
+  void broker_client::commit(unsigned key)
+  {
+    if (key >= m_key_count || (m_keys & (uint64_t(1) << key)) == 0)
+      return;
+
+    auto shm = static_cast<shm_header*>(m_mem);
+    shm->dirty.fetch_or(uint64_t(1) << key);
+    shm->dirty_wake.fetch_add(1);
+    futex_wake(shm->dirty_wake);
+  }
+
+
+  std::optional<uint64_t> broker_client::read(int timeout)
+  {
+    auto shm = static_cast<shm_header*>(m_mem);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+    while (true) {
+      auto head = shm->input_head.load(std::memory_order_acquire);
+      while (m_tail < head) {
+        if (head - m_tail > input_ring_size)
+          m_tail = head - input_ring_size;
+
+        auto& slot = shm->input[m_tail % input_ring_size];
+        auto seq = slot.seq.load(std::memory_order_acquire);
+        auto keys = slot.keys.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq != m_tail + 1 || slot.seq.load(std::memory_order_relaxed) != seq) {
+          // The slot is overwritten, skip it and everything older.
+          head = shm->input_head.load(std::memory_order_acquire);
+          m_tail = head >= input_ring_size ? std::max(m_tail + 1, head - input_ring_size + 1) : m_tail + 1;
+          continue;
+        }
+        ++m_tail;
+
+        keys &= m_keys;
+        if (keys != m_last) {
+          m_last = keys;
+          return keys;
+        }
+      }
+
+      int remaining = -1;
+      if (timeout >= 0) {
+        remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if (remaining <= 0)
+          return std::nullopt;
+      }
+
+      auto w = shm->input_wake.load(std::memory_order_acquire);
+      if (shm->input_head.load(std::memory_order_acquire) == head)
+        futex_wait(shm->input_wake, w, remaining);
+    }
+  }
+
+} // namespace streamdeck
@@ -1,60 +1,580 @@
 #include "streamdeckpp.hh"
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <list>
+#include <map>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 using namespace std::string_literals;
 
 
+namespace {
+
+  // Location of the control socket of the daemon.  It can be overwritten with the
+  // STREAMDECK_SOCKET environment variable.
+  std::string socket_path()
+  {
+    if (auto s = getenv("STREAMDECK_SOCKET"); s != nullptr && *s != '\0')
+      return s;
+    if (auto s = getenv("XDG_RUNTIME_DIR"); s != nullptr && *s != '\0')
+      return s + "/streamdeck.sock"s;
+    return "/tmp/streamdeck-"s + std::to_string(getuid()) + ".sock";
+  }
+
+
+  bool fill_address(sockaddr_un& sun, const std::string& path)
+  {
+    if (path.size() >= sizeof(sun.sun_path))
+      return false;
+    sun = {};
+    sun.sun_family = AF_UNIX;
+    path.copy(sun.sun_path, path.size());
+    return true;
+  }
+
+
+  int connect_daemon(const std::string& path)
+  {
+    sockaddr_un sun;
+    if (! fill_address(sun, path))
+      return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+      return -1;
+    if (connect(fd, reinterpret_cast<sockaddr*>(&sun), sizeof(sun)) != 0) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+
+  bool write_all(int fd, const char* p, size_t n)
+  {
+    while (n > 0) {
+      auto r = send(fd, p, n, MSG_NOSIGNAL);
+      if (r < 0) {
+        if (errno == EINTR)
+          continue;
+        return false;
+      }
+      p += r;
+      n -= r;
+    }
+    return true;
+  }
+
+
+  bool write_all(int fd, const std::string& s)
+  {
+    return write_all(fd, s.data(), s.size());
+  }
+
+
+  void print_state(std::ostream& os, const std::vector<bool>& ss)
+  {
+    for (auto s : ss)
+      os << ' ' << s;
+    os << std::endl;
+  }
+
+
+  // Encoded key images kept by the daemon.  The images are identified by device and
+  // absolute path name.  A changed modification time causes the file to be loaded again,
+  // the new image replaces the old one under the same handle.
+  struct image_cache {
+    int get(streamdeck::device_type& dev, size_t devidx, const std::filesystem::path& fname)
+    {
+      std::error_code ec;
+      auto mtime = std::filesystem::last_write_time(fname, ec);
+      auto& e = entries[std::make_pair(devidx, fname.string())];
+      if (e.handle < 0)
+        e.handle = dev.register_image(fname.c_str());
+      else if (ec || e.mtime != mtime)
+        dev.replace_image(e.handle, fname.c_str());
+      else
+        return e.handle;
+      e.mtime = mtime;
+      return e.handle;
+    }
+
+  private:
+    struct entry {
+      int handle = -1;
+      std::filesystem::file_time_type mtime;
+    };
+    std::map<std::pair<size_t, std::string>, entry> entries;
+  };
+
+
+  void write_trace(streamdeck::context& ctx, const std::filesystem::path& fname)
+  {
+    std::ofstream out(fname);
+    ctx.trace_write(out);
+  }
+
+
+  // Execute the command in ARGS for all devices.  The current directory CWD is used to locate
+  // image files given with relative path names.  If CACHE is not null the encoded images are
+  // reused.  Output goes to OS, error messages to ERR.  The result is the exit status.  The
+  // read commands loop forever; the daemon handles them separately.
+  int execute(streamdeck::context& ctx, const std::vector<std::string>& args, const std::filesystem::path& cwd, std::ostream& os, std::ostream& err, image_cache* cache = nullptr)
+  {
+    auto argc = args.size();
+    int status = EXIT_SUCCESS;
+
+    for (size_t i = 0; i < ctx.size(); ++i) {
+      if (! ctx[i]->connected()) {
+        err << "cannot open device " << i << std::endl;
+        status = EXIT_FAILURE;
+        continue;
+      }
+
+      int r = 0;
+      if ("image"s == args[0]) {
+        int key = argc <= 1 ? 0 : atoi(args[1].c_str());
+        auto fname = cwd / (argc <= 2 ? "test.jpg"s : args[2]);
+        if (cache != nullptr)
+          r = ctx[i]->set_key_image(key, cache->get(*ctx[i], i, fname));
+        else
+          r = ctx[i]->set_key_image(key, fname.c_str());
+      } else if ("touch"s == args[0]) {
+        int offset = argc <= 1 ? 0 : atoi(args[1].c_str());
+        auto fname = cwd / (argc <= 2 ? "test.jpg"s : args[2]);
+        r = ctx[i]->set_touch_image(offset, fname.c_str());
+      } else if ("reset"s == args[0])
+        ctx[i]->reset();
+      else if ("brightness"s == args[0]) {
+        unsigned percent = argc == 1 ? 50 : atoi(args[1].c_str());
+        ctx[i]->set_brightness(percent);
+      } else if ("serial"s == args[0])
+        os << ctx[i]->get_serial_number() << std::endl;
+      else if ("firmware"s == args[0])
+        os << ctx[i]->get_firmware_version() << std::endl;
+      else if ("state"s == args[0]) {
+        auto st = ctx[i]->key_state();
+        os << st.sequence << ':';
+        for (unsigned k = 0; k < ctx[i]->key_count; ++k)
+          os << ' ' << ((st.pressed >> k) & 1);
+        os << std::endl;
+      } else if ("read"s == args[0]) {
+        while (true)
+          print_state(os, ctx[i]->read());
+      } else if ("timeout"s == args[0]) {
+        auto t = argc < 2 ? 1000 : atoi(args[1].c_str());
+        while (true) {
+          auto ss = ctx[i]->read(t);
+          if (ss)
+            print_state(os, *ss);
+          else
+            os << "nothing\n";
+        }
+      }
+
+      if (r < 0) {
+        err << args[0] << " failed for device " << i << std::endl;
+        status = EXIT_FAILURE;
+      }
+    }
+
+    return status;
+  }
+
+
+  // Forward the command line to a running daemon and copy the output.  The reply starts with
+  // a byte containing the exit status, followed by the standard output, a NUL byte, and the
+  // error messages.
+  int run_client(int fd, int argc, char* argv[])
+  {
+    std::error_code ec;
+    auto req = std::filesystem::current_path(ec).string();
+    for (int i = 1; i < argc; ++i) {
+      req += '\0';
+      req += argv[i];
+    }
+    if (! write_all(fd, req))
+      error(EXIT_FAILURE, errno, "cannot send request to daemon");
+    shutdown(fd, SHUT_WR);
+
+    int status = -1;
+    bool in_err = false;
+    char buf[4096];
+    ssize_t n;
+    while ((n = ::read(fd, buf, sizeof(buf))) != 0)
+      if (n > 0) {
+        const char* p = buf;
+        if (status == -1) {
+          status = static_cast<unsigned char>(*p++);
+          --n;
+        }
+        if (! in_err) {
+          auto nul = static_cast<const char*>(memchr(p, '\0', n));
+          auto m = nul == nullptr ? n : nul - p;
+          std::cout.write(p, m).flush();
+          in_err = nul != nullptr;
+          p += m + in_err;
+          n -= m + in_err;
+        }
+        if (in_err)
+          std::cerr.write(p, n).flush();
+      } else if (errno != EINTR)
+        break;
+
+    close(fd);
+    if (status == -1)
+      error(EXIT_FAILURE, 0, "no reply from daemon");
+    return status;
+  }
+
+
+  struct daemon_state {
+    daemon_state(streamdeck::context& ctx_) : ctx(ctx_), seq(ctx.size()), keys(ctx.size()) {}
+
+    streamdeck::context& ctx;
+    image_cache cache;
+
+    // Latest key state of each device, updated by the reader threads.
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<uint64_t> seq;
+    std::vector<std::vector<bool>> keys;
+    bool done = false;
+
+    struct subscription {
+      int fd;
+      std::atomic<bool> finished = false;
+      std::thread thr;
+    };
+    std::list<subscription> subscriptions;
+
+    void reader(size_t i);
+    void subscriber(subscription& sub, int timeout);
+    void subscribe(int fd, int timeout);
+    void prune();
+  };
+
+
+  void daemon_state::reader(size_t i)
+  {
+    while (true) {
+      {
+        std::lock_guard guard(lock);
+        if (done)
+          break;
+      }
+      std::optional<std::vector<bool>> ss;
+      try {
+        ss = ctx[i]->read(100);
+      } catch (const std::exception& e) {
+        // Most likely the device was unplugged.  Keep serving the other devices.
+        error(0, 0, "cannot read from device %zu: %s", i, e.what());
+        break;
+      }
+      if (ss) {
+        std::lock_guard guard(lock);
+        keys[i] = std::move(*ss);
+        ++seq[i];
+        cond.notify_all();
+      }
+    }
+  }
+
+
+  // Send all key state changes to a subscriber.  With a non-negative TIMEOUT the line "nothing"
+  // is sent whenever no change happened for that many milliseconds, like the "timeout" command.
+  void daemon_state::subscriber(subscription& sub, int timeout)
+  {
+    std::unique_lock guard(lock);
+    auto seen = seq;
+    while (! done) {
+      auto changed = [this, &seen] { return done || seen != seq; };
+      if (timeout < 0)
+        cond.wait(guard, changed);
+      else if (! cond.wait_for(guard, std::chrono::milliseconds(timeout), changed)) {
+        guard.unlock();
+        auto ok = write_all(sub.fd, "nothing\n"s);
+        guard.lock();
+        if (! ok)
+          break;
+        continue;
+      }
+      if (done)
+        break;
+
+      std::ostringstream os;
+      for (size_t i = 0; i < seq.size(); ++i)
+        if (seen[i] != seq[i]) {
+          if (seq.size() > 1)
+            os << i << ':';
+          print_state(os, keys[i]);
+        }
+      seen = seq;
+
+      guard.unlock();
+      auto ok = write_all(sub.fd, os.str());
+      guard.lock();
+      if (! ok)
+        break;
+    }
+
+    close(sub.fd);
+    sub.fd = -1;
+    sub.finished = true;
+  }
+
+
+  void daemon_state::subscribe(int fd, int timeout)
+  {
+    std::lock_guard guard(lock);
+    auto& sub = subscriptions.emplace_back(fd);
+    sub.thr = std::thread([this, &sub, timeout] { subscriber(sub, timeout); });
+  }
+
+
+  void daemon_state::prune()
+  {
+    std::lock_guard guard(lock);
+    std::erase_if(subscriptions, [](auto& sub) {
+      if (! sub.finished)
+        return false;
+      sub.thr.join();
+      return true;
+    });
+  }
+
+
+  // Keep the context and the encoded images in memory and execute the commands received
+  // over the control socket.  The process stops on SIGINT and SIGTERM.
+  int run_daemon(const std::string& path)
+  {
+    sockaddr_un sun;
+    if (! fill_address(sun, path))
+      error(EXIT_FAILURE, 0, "socket path %s too long", path.c_str());
+
+    if (auto fd = connect_daemon(path); fd != -1) {
+      close(fd);
+      error(EXIT_FAILURE, 0, "daemon already running on %s", path.c_str());
+    }
+
+    // Signals are handled synchronously.  They must be blocked before any thread is created,
+    // including those of the HID library.
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, nullptr);
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd == -1)
+      error(EXIT_FAILURE, errno, "cannot create socket");
+    unlink(path.c_str());
+    auto oldmask = umask(0077);
+    if (bind(lfd, reinterpret_cast<sockaddr*>(&sun), sizeof(sun)) != 0)
+      error(EXIT_FAILURE, errno, "cannot bind to %s", path.c_str());
+    umask(oldmask);
+    if (listen(lfd, SOMAXCONN) != 0)
+      error(EXIT_FAILURE, errno, "cannot listen on %s", path.c_str());
+
+    streamdeck::context ctx;
+    if (ctx.empty())
+      error(EXIT_FAILURE, 0, "failed streamdeck::context initialization");
+
+    daemon_state state(ctx);
+
+    auto trace = getenv("STREAMDECK_TRACE");
+    if (trace != nullptr)
+      ctx.trace_start();
+
+    std::atomic<bool> stop = false;
+    std::thread sigthr([&sigs, &stop, lfd] {
+      int sig;
+      sigwait(&sigs, &sig);
+      stop = true;
+      shutdown(lfd, SHUT_RDWR);
+    });
+
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i < ctx.size(); ++i)
+      if (ctx[i]->connected())
+        readers.emplace_back(&daemon_state::reader, &state, i);
+
+    while (! stop) {
+      int fd = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd == -1) {
+        if (errno == EINTR || errno == ECONNABORTED)
+          continue;
+        break;
+      }
+
+      state.prune();
+
+      // Do not let a misbehaving client block the daemon.
+      timeval tv{1, 0};
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+      std::string req;
+      char buf[4096];
+      ssize_t n;
+      while ((n = ::read(fd, buf, sizeof(buf))) > 0)
+        req.append(buf, n);
+
+      std::vector<std::string> args;
+      std::istringstream is(req);
+      for (std::string a; std::getline(is, a, '\0');)
+        args.emplace_back(std::move(a));
+      if (args.size() < 2) {
+        close(fd);
+        continue;
+      }
+      std::filesystem::path cwd(args.front());
+      args.erase(args.begin());
+
+      if ("read"s == args[0] || "timeout"s == args[0]) {
+        int timeout = "read"s == args[0] ? -1 : args.size() < 2 ? 1000 : atoi(args[1].c_str());
+        if (write_all(fd, std::string(1, char(EXIT_SUCCESS))))
+          state.subscribe(fd, timeout);
+        else
+          close(fd);
+        continue;
+      }
+
+      // See run_client for the format of the reply.
+      std::ostringstream os;
+      std::ostringstream err;
+      int status = EXIT_SUCCESS;
+      try {
+        if ("trace"s == args[0]) {
+          if (args.size() > 1 && "start"s == args[1])
+            ctx.trace_start();
+          else if (args.size() > 1 && "stop"s == args[1])
+            ctx.trace_stop();
+          else if (args.size() > 2 && "write"s == args[1])
+            write_trace(ctx, cwd / args[2]);
+          else {
+            err << "usage: trace start|stop|write FILE" << std::endl;
+            status = EXIT_FAILURE;
+          }
+        } else
+          status = execute(ctx, args, cwd, os, err, &state.cache);
+      } catch (const std::exception& e) {
+        err << e.what() << std::endl;
+        status = EXIT_FAILURE;
+      }
+      write_all(fd, char(status) + os.str() + '\0' + err.str());
+      close(fd);
+    }
+
+    {
+      std::lock_guard guard(state.lock);
+      state.done = true;
+      for (auto& sub : state.subscriptions)
+        if (sub.fd != -1)
+          shutdown(sub.fd, SHUT_RDWR);
+    }
+    state.cond.notify_all();
+    for (auto& sub : state.subscriptions)
+      sub.thr.join();
+    for (auto& thr : readers)
+      thr.join();
+
+    if (! stop)
+      pthread_kill(sigthr.native_handle(), SIGTERM);
+    sigthr.join();
+
+    close(lfd);
+    unlink(path.c_str());
+
+    if (trace != nullptr)
+      write_trace(ctx, trace);
+    return EXIT_SUCCESS;
+  }
+
+
+  // Share the devices with other processes through a streamdeck::broker.
+  int run_broker(const char* path)
+  {
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, nullptr);
+
+    streamdeck::context ctx;
+    if (ctx.empty())
+      error(EXIT_FAILURE, 0, "failed streamdeck::context initialization");
+
+    std::optional<streamdeck::broker> b;
+    try {
+      b.emplace(ctx, path);
+    } catch (const std::exception& e) {
+      error(EXIT_FAILURE, 0, "cannot start broker: %s", e.what());
+    }
+
+    std::atomic<bool> stop = false;
+    std::thread sigthr([&sigs, &stop, &b] {
+      int sig;
+      sigwait(&sigs, &sig);
+      stop = true;
+      b->stop();
+    });
+
+    b->run();
+
+    if (! stop)
+      pthread_kill(sigthr.native_handle(), SIGTERM);
+    sigthr.join();
+    return EXIT_SUCCESS;
+  }
+
+} // anonymous namespace
+
+
 int main(int argc, char* argv[])
 {
   if (argc == 1)
     return 0;
 
+  auto path = socket_path();
+  if ("daemon"s == argv[1])
+    return run_daemon(argc > 2 ? argv[2] : path);
+  if ("broker"s == argv[1])
+    return run_broker(argc > 2 ? argv[2] : streamdeck::broker::default_path().c_str());
+
+  if (auto fd = connect_daemon(path); fd != -1)
+    return run_client(fd, argc, argv);
+
   streamdeck::context ctx;
   if (ctx.empty())
     error(EXIT_FAILURE, 0, "failed streamdeck::context initialization");
 
-  for (size_t i = 0; i < ctx.size(); ++i) {
-    if (! ctx[i]->connected()) {
-      std::cout << "cannot open device " << i << std::endl;
-      continue;
-    }
-
-    if ("image"s == argv[1]) {
-      int key = argc <= 2 ? 0 : atoi(argv[2]);
-      const char* fname = argc <= 3 ? "test.jpg" : argv[3];
-      ctx[i]->set_key_image(key, fname);
-    } else if ("touch"s == argv[1]) {
-      int offset = argc <= 2 ? 0 : atoi(argv[2]);
-      const char* fname = argc <= 3 ? "test.jpg" : argv[3];
-      ctx[i]->set_touch_image(offset, fname);
-    } else if ("reset"s == argv[1])
-      ctx[i]->reset();
-    else if ("brightness"s == argv[1]) {
-      unsigned percent = argc == 2 ? 50 : atoi(argv[2]);
-      ctx[i]->set_brightness(percent);
-    } else if ("serial"s == argv[1])
-      std::cout << ctx[i]->get_serial_number() << std::endl;
-    else if ("firmware"s == argv[1])
-      std::cout << ctx[i]->get_firmware_version() << std::endl;
-    else if ("read"s == argv[1]) {
-      while (true) {
-        auto ss = ctx[i]->read();
-        for (auto s : ss)
-          std::cout << ' ' << s;
-        std::cout << std::endl;
-      }
-    } else if ("timeout"s == argv[1]) {
-      auto t = argc < 3 ? 1000 : atoi(argv[2]);
-      while (true) {
-        auto ss = ctx[i]->read(t);
-        if (ss) {
-          for (auto s : *ss)
-            std::cout << ' ' << s;
-          std::cout << std::endl;
-        } else
-          std::cout << "nothing\n";
-      }
-    }
+  auto trace = getenv("STREAMDECK_TRACE");
+  if (trace != nullptr)
+    ctx.trace_start();
+
+  std::error_code ec;
+  int status;
+  try {
+    status = execute(ctx, std::vector<std::string>(argv + 1, argv + argc), std::filesystem::current_path(ec), std::cout, std::cerr);
+  } catch (const std::exception& e) {
+    error(0, 0, "%s", e.what());
+    status = EXIT_FAILURE;
   }
+
+  if (trace != nullptr)
+    write_trace(ctx, trace);
+  return status;
 }
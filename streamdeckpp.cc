@@ -2,9 +2,25 @@
 #include "Magick++/Blob.h"
 #include "hidapi.h"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
+#include <cctype>
+#include <csetjmp>
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <format>
+#include <mutex>
+#include <ostream>
 #include <print>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <utility>
+#include <jpeglib.h>
+#include <unistd.h>
 
 using namespace std::string_literals;
 
@@ -22,12 +38,334 @@ namespace streamdeck {
       const char* back;
     };
 
+
+    // ImageMagick parallelizes operations on a single image with its own threads.  While the
+    // images are handled in parallel this only oversubscribes the cores.  The limit is global;
+    // with overlapping users the first one saves and the last one restores it.
+    struct magick_single_thread {
+      magick_single_thread()
+      {
+        std::lock_guard guard(lock);
+        if (users++ == 0) {
+          saved = Magick::ResourceLimits::thread();
+          Magick::ResourceLimits::thread(1);
+        }
+      }
+
+      ~magick_single_thread()
+      {
+        std::lock_guard guard(lock);
+        if (--users == 0)
+          Magick::ResourceLimits::thread(saved);
+      }
+
+      static inline std::mutex lock;
+      static inline unsigned users = 0;
+      static inline Magick::MagickSizeType saved;
+    };
+
+
+    // Call FN for all indices below N, distributed over as many threads as there are cores.
+    // The first exception thrown by FN is rethrown after all threads finished.  FN is expected
+    // to use ImageMagick, which is therefore limited to one thread per call of FN.
+    template<typename F>
+    void parallel_for(size_t n, F&& fn)
+    {
+      magick_single_thread limit;
+      std::atomic<size_t> next = 0;
+      std::exception_ptr exc;
+      std::mutex exc_lock;
+
+      auto worker = [&] {
+        for (size_t i; (i = next++) < n;)
+          try {
+            fn(i);
+          }
+          catch (...) {
+            std::lock_guard guard(exc_lock);
+            if (! exc)
+              exc = std::current_exception();
+            next = n;
+          }
+      };
+
+      auto nthreads = std::min<size_t>(n, std::max(1u, std::thread::hardware_concurrency()));
+      {
+        std::vector<std::jthread> threads;
+        for (size_t t = 1; t < nthreads; ++t)
+          threads.emplace_back(worker);
+        worker();
+      }
+
+      if (exc)
+        std::rethrow_exception(exc);
+    }
+
+
+
+    // Trace events are collected in a ring buffer in the format needed for the Chrome trace event
+    // format.  With tracing disabled a span costs a single relaxed load.
+    // The serial number is copied since the events can outlive the device objects.
+    struct trace_event {
+      const char* name;
+      const char* cat;
+      char id[32];
+      int key;
+      int page;
+      int offset;
+      pid_t tid;
+      std::chrono::steady_clock::time_point start;
+      std::chrono::steady_clock::duration dur;
+    };
+
+    struct trace_buffer {
+      std::atomic<bool> enabled = false;
+      std::mutex lock;
+      std::vector<trace_event> ring;
+      size_t total = 0;
+      std::chrono::steady_clock::time_point epoch;
+
+      void add(const trace_event& ev)
+      {
+        std::lock_guard guard(lock);
+        if (enabled)
+          ring[total++ % ring.size()] = ev;
+      }
+    } tracer;
+
+
+    pid_t trace_tid()
+    {
+      static thread_local pid_t tid = gettid();
+      return tid;
+    }
+
+
+    struct trace_span {
+      trace_span(const char* name_, const char* cat_, const std::string& id_, int key_ = -1, int page_ = -1, int offset_ = -1)
+      {
+        if (tracer.enabled.load(std::memory_order_acquire)) [[unlikely]] {
+          ev = trace_event{name_, cat_, {}, key_, page_, offset_, trace_tid(), {}, {}};
+          id_.copy(ev.id, sizeof(ev.id) - 1);
+          ev.start = std::chrono::steady_clock::now();
+        }
+      }
+
+      // Do not record the span.
+      void discard() { ev.name = nullptr; }
+
+      ~trace_span()
+      {
+        if (ev.name != nullptr) [[unlikely]] {
+          ev.dur = std::chrono::steady_clock::now() - ev.start;
+          tracer.add(ev);
+        }
+      }
+
+      trace_event ev{};
+    };
+
+
+    // Position of the color channels in the raw pixel formats.  A negative alpha position means
+    // there is no alpha channel.
+    struct pixel_layout {
+      unsigned bpp;
+      unsigned r;
+      unsigned g;
+      unsigned b;
+      int a;
+    };
+
+    constexpr pixel_layout get_layout(device_type::pixel_format fmt)
+    {
+      switch (fmt) {
+      case device_type::pixel_format::rgb:
+        return {3, 0, 1, 2, -1};
+      case device_type::pixel_format::bgr:
+        return {3, 2, 1, 0, -1};
+      case device_type::pixel_format::rgba:
+        return {4, 0, 1, 2, 3};
+      case device_type::pixel_format::bgra:
+        return {4, 2, 1, 0, 3};
+      }
+      std::unreachable();
+    }
+
+    bool valid_pixels(std::span<const std::byte> pixels, unsigned width, unsigned height, size_t stride, device_type::pixel_format fmt)
+    {
+      auto rowlen = size_t(width) * get_layout(fmt).bpp;
+      return width > 0 && height > 0 && stride >= rowlen && pixels.size() >= (height - 1) * stride + rowlen;
+    }
+
+    // Add the color values of the pixel at P to SUM.  Transparent pixels are composited on black,
+    // the same background used when images are scaled.
+    inline void add_pixel(unsigned long sum[3], const std::byte* p, const pixel_layout& layout)
+    {
+      unsigned a = layout.a < 0 ? 255 : unsigned(p[layout.a]);
+      sum[0] += unsigned(p[layout.r]) * a / 255;
+      sum[1] += unsigned(p[layout.g]) * a / 255;
+      sum[2] += unsigned(p[layout.b]) * a / 255;
+    }
+
+
+    // Coordinates in the transformed image (u, v) map to source pixels (x, y) according to
+    //   x = xu * u + xv * v + x0
+    //   y = yu * u + yv * v + y0
+    // The transformations correspond to the Magick::Image operations used in reformat.
+    struct orientation {
+      orientation(unsigned w, unsigned h) : width(w), height(h) {}
+
+      long xu = 1, xv = 0, x0 = 0;
+      long yu = 0, yv = 1, y0 = 0;
+      unsigned width;
+      unsigned height;
+
+      void transpose() { apply(0, 1, 0, 1, 0, 0); }
+      void transverse() { apply(0, -1, long(width) - 1, -1, 0, long(height) - 1); }
+      void rotate() { apply(0, 1, 0, -1, 0, long(height) - 1); }
+
+    private:
+      // The previous coordinates in terms of the new: u = pu * u' + pv * v' + p0, v = qu * u' + qv * v' + q0.
+      // All the transformations exchange width and height.
+      void apply(long pu, long pv, long p0, long qu, long qv, long q0)
+      {
+        std::tie(xu, xv, x0) = std::make_tuple(xu * pu + xv * qu, xu * pv + xv * qv, xu * p0 + xv * q0 + x0);
+        std::tie(yu, yv, y0) = std::make_tuple(yu * pu + yv * qu, yu * pv + yv * qv, yu * p0 + yv * q0 + y0);
+        std::swap(width, height);
+      }
+    };
+
+
+    std::vector<unsigned char> to_rgb(std::span<const std::byte> pixels, unsigned width, unsigned height, size_t stride, device_type::pixel_format fmt)
+    {
+      auto layout = get_layout(fmt);
+      std::vector<unsigned char> res(size_t(width) * height * 3);
+      auto out = res.begin();
+      for (unsigned y = 0; y < height; ++y)
+        for (unsigned x = 0; x < width; ++x) {
+          unsigned long sum[3]{};
+          add_pixel(sum, pixels.data() + y * stride + x * layout.bpp, layout);
+          out = std::copy(std::begin(sum), std::end(sum), out);
+        }
+      return res;
+    }
+
+
+    device_type::payload_type encode_bmp(const std::vector<unsigned char>& rgb, unsigned width, unsigned height)
+    {
+      static constexpr size_t header_length = 54;
+      size_t rowlen = (size_t(width) * 3 + 3) & ~size_t(3);
+      size_t datalen = rowlen * height;
+
+      device_type::payload_type res(header_length + datalen);
+      auto put = [&res](size_t off, uint32_t val, unsigned n) {
+        for (unsigned i = 0; i < n; ++i)
+          res[off + i] = std::byte(val >> (8 * i));
+      };
+      res[0] = std::byte('B');
+      res[1] = std::byte('M');
+      put(2, res.size(), 4);
+      put(10, header_length, 4);
+      put(14, 40, 4);
+      put(18, width, 4);
+      put(22, height, 4);
+      put(26, 1, 2);
+      put(28, 24, 2);
+      put(34, datalen, 4);
+      put(38, 2835, 4);
+      put(42, 2835, 4);
+
+      // Rows are stored bottom-up, pixels as BGR.
+      for (unsigned y = 0; y < height; ++y) {
+        auto src = rgb.data() + size_t(height - 1 - y) * width * 3;
+        auto dst = res.begin() + header_length + y * rowlen;
+        for (unsigned x = 0; x < width; ++x, src += 3) {
+          *dst++ = std::byte(src[2]);
+          *dst++ = std::byte(src[1]);
+          *dst++ = std::byte(src[0]);
+        }
+      }
+
+      return res;
+    }
+
+
+    // Exceptions must not pass through the frames of libjpeg.  Errors longjmp back to
+    // compress_jpeg.  The output buffer is kept here since locals of the function calling
+    // setjmp which change before longjmp have indeterminate values afterwards.
+    struct jpeg_error {
+      jpeg_error_mgr mgr;
+      std::jmp_buf env;
+      char msg[JMSG_LENGTH_MAX];
+      unsigned char* out = nullptr;
+      unsigned long outlen = 0;
+    };
+
+    bool compress_jpeg(jpeg_compress_struct& cinfo, jpeg_error& err, const std::vector<unsigned char>& rgb, unsigned width, unsigned height)
+    {
+      if (setjmp(err.env) != 0)
+        return false;
+
+      jpeg_create_compress(&cinfo);
+      jpeg_mem_dest(&cinfo, &err.out, &err.outlen);
+      cinfo.image_width = width;
+      cinfo.image_height = height;
+      cinfo.input_components = 3;
+      cinfo.in_color_space = JCS_RGB;
+      jpeg_set_defaults(&cinfo);
+      // The default quality used by ImageMagick.
+      jpeg_set_quality(&cinfo, 92, TRUE);
+      jpeg_start_compress(&cinfo, TRUE);
+      while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = const_cast<unsigned char*>(rgb.data() + size_t(cinfo.next_scanline) * width * 3);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+      }
+      jpeg_finish_compress(&cinfo);
+      return true;
+    }
+
+    device_type::payload_type encode_jpeg(const std::vector<unsigned char>& rgb, unsigned width, unsigned height)
+    {
+      // Zero-initialized so that destroying is safe even if creating failed.
+      jpeg_compress_struct cinfo{};
+      jpeg_error err;
+      cinfo.err = jpeg_std_error(&err.mgr);
+      err.mgr.error_exit = [](j_common_ptr info) {
+        auto e = reinterpret_cast<jpeg_error*>(info->err);
+        info->err->format_message(info, e->msg);
+        std::longjmp(e->env, 1);
+      };
+
+      auto ok = compress_jpeg(cinfo, err, rgb, width, height);
+      jpeg_destroy_compress(&cinfo);
+      if (! ok) {
+        free(err.out);
+        throw std::runtime_error("JPEG encoding failed: "s + err.msg);
+      }
+
+      device_type::payload_type res(reinterpret_cast<const std::byte*>(err.out), reinterpret_cast<const std::byte*>(err.out) + err.outlen);
+      free(err.out);
+      return res;
+    }
+
+
+    // Icon directories usually contain other files as well (index.theme, README, ...).  Only the
+    // files with the extension of a common image format are used.
+    bool is_image_file(const std::filesystem::path& fname)
+    {
+      static constexpr std::array extensions{".png", ".jpg", ".jpeg", ".bmp", ".gif", ".webp", ".tif", ".tiff", ".ico", ".xpm", ".ppm", ".pgm"};
+      auto ext = fname.extension().string();
+      std::ranges::transform(ext, ext.begin(), [](unsigned char c) { return std::tolower(c); });
+      return std::ranges::find(extensions, ext) != extensions.end();
+    }
+
   } // anonymous namespace
 
   device_type::device_type(const char* path, unsigned width, unsigned height, unsigned cols, unsigned rows, image_format_type imgfmt, unsigned imgreplen, bool hflip, bool vflip, unsigned rotate)
-      : pixel_width(width), pixel_height(height), key_cols(cols), key_rows(rows), key_count(rows * cols), key_image_format(imgfmt), key_hflip(hflip), key_vflip(vflip), key_rotate(rotate), image_report_length(imgreplen), m_path(path), m_d(hid_open_path(m_path))
+      : pixel_width(width), pixel_height(height), key_cols(cols), key_rows(rows), key_count(rows * cols), key_image_format(imgfmt), key_hflip(hflip), key_vflip(vflip), key_rotate(rotate), image_report_length(imgreplen), m_path(path), m_d(path == nullptr ? nullptr : hid_open_path(m_path))
   {
-    if (m_d == nullptr) [[unlikely]] {
+    // Without a path the object is not connected to any device.
+    if (m_d == nullptr && path != nullptr) [[unlikely]] {
       auto ws = hid_error(nullptr);
       char buf[1000];
       auto* wp = buf;
@@ -45,14 +383,76 @@ namespace streamdeck {
     close();
   }
 
+  void device_type::publish_key_state(const std::vector<bool>& state)
+  {
+    uint64_t pressed = 0;
+    for (size_t i = 0; i < std::min<size_t>(state.size(), max_keys); ++i)
+      if (state[i])
+        pressed |= uint64_t(1) << i;
+    publish_key_state(pressed);
+  }
+
+  void device_type::publish_key_state(uint64_t pressed)
+  {
+    // Normally only one thread reads but do not rely on it.
+    auto s = m_key_seq.load(std::memory_order_relaxed);
+    do
+      while ((s & 1) != 0)
+        s = m_key_seq.load(std::memory_order_relaxed);
+    while (! m_key_seq.compare_exchange_weak(s, s + 1, std::memory_order_acquire, std::memory_order_relaxed));
+    std::atomic_thread_fence(std::memory_order_release);
+
+    auto seq = s / 2 + 1;
+    for (auto changed = m_key_pressed.load(std::memory_order_relaxed) ^ pressed; changed != 0; changed &= changed - 1)
+      m_key_changed[std::countr_zero(changed)].store(seq, std::memory_order_relaxed);
+    m_key_pressed.store(pressed, std::memory_order_relaxed);
+
+    m_key_seq.store(s + 2, std::memory_order_release);
+  }
+
+  device_type::key_snapshot device_type::key_state() const
+  {
+    key_snapshot res;
+    uint64_t s;
+    do {
+      s = m_key_seq.load(std::memory_order_acquire);
+      res.pressed = m_key_pressed.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((s & 1) != 0 || m_key_seq.load(std::memory_order_relaxed) != s);
+    res.sequence = s / 2;
+    return res;
+  }
+
+  uint64_t device_type::changed_since(uint64_t sequence) const
+  {
+    uint64_t res;
+    uint64_t s;
+    do {
+      s = m_key_seq.load(std::memory_order_acquire);
+      res = 0;
+      for (unsigned i = 0; i < std::min(key_count, max_keys); ++i)
+        if (m_key_changed[i].load(std::memory_order_relaxed) > sequence)
+          res |= uint64_t(1) << i;
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((s & 1) != 0 || m_key_seq.load(std::memory_order_relaxed) != s);
+    return res;
+  }
+
   void device_type::close()
   {
     if (connected())
       hid_close(m_d);
   }
 
-  Magick::Blob device_type::create_blob(Magick::Image&& image)
+  Magick::Image device_type::decode(const char* fname, int key)
+  {
+    trace_span span("decode", "image", trace_id, key);
+    return Magick::Image(fname);
+  }
+
+  Magick::Blob device_type::create_blob(Magick::Image&& image, int key)
   {
+    trace_span span("create_blob", "image", trace_id, key);
     if (key_image_format == image_format_type::jpeg)
       image.magick("JPEG");
     else if (key_image_format == image_format_type::bmp)
@@ -63,8 +463,9 @@ namespace streamdeck {
     return res;
   }
 
-  Magick::Blob device_type::reformat(Magick::Image&& image)
+  Magick::Blob device_type::reformat(Magick::Image&& image, int key)
   {
+    trace_span span("reformat", "image", trace_id, key);
     if (key_hflip)
       image.transpose();
     if (key_vflip)
@@ -88,7 +489,67 @@ namespace streamdeck {
       }
     }
 
-    return create_blob(std::move(image));
+    return create_blob(std::move(image), key);
+  }
+
+  device_type::payload_type device_type::encode(const std::vector<unsigned char>& rgb, unsigned width, unsigned height, int key)
+  {
+    trace_span span("encode", "image", trace_id, key);
+    if (key_image_format == image_format_type::jpeg)
+      return encode_jpeg(rgb, width, height);
+    return encode_bmp(rgb, width, height);
+  }
+
+  // Same as reformat for a Magick::Image but the transformation and scaling are computed directly
+  // on the caller's pixels.  Each key pixel is the average of the source pixels it covers.
+  device_type::payload_type device_type::reformat(std::span<const std::byte> pixels, unsigned width, unsigned height, size_t stride, pixel_format fmt, int key)
+  {
+    trace_span span("reformat", "image", trace_id, key);
+
+    orientation o(width, height);
+    if (key_hflip)
+      o.transpose();
+    if (key_vflip)
+      o.transverse();
+    for (unsigned r = 0; r < key_rotate % 4; ++r)
+      o.rotate();
+
+    unsigned new_width = pixel_width;
+    unsigned new_height = pixel_height;
+    if (o.width != pixel_width || o.height != pixel_height) {
+      auto factor = std::min(double(pixel_width) / o.width, double(pixel_height) / o.height);
+      new_width = o.width * factor;
+      new_height = o.height * factor;
+    }
+    auto xoff = (pixel_width - new_width) / 2;
+    auto yoff = (pixel_height - new_height) / 2;
+
+    auto layout = get_layout(fmt);
+    std::vector<unsigned char> rgb(size_t(pixel_width) * pixel_height * 3);
+    for (unsigned row = 0; row < new_height; ++row) {
+      unsigned v0 = size_t(row) * o.height / new_height;
+      unsigned v1 = std::max<unsigned>(v0 + 1, size_t(row + 1) * o.height / new_height);
+      auto out = rgb.begin() + (size_t(yoff + row) * pixel_width + xoff) * 3;
+
+      for (unsigned col = 0; col < new_width; ++col) {
+        unsigned u0 = size_t(col) * o.width / new_width;
+        unsigned u1 = std::max<unsigned>(u0 + 1, size_t(col + 1) * o.width / new_width);
+
+        unsigned long sum[3]{};
+        for (long v = v0; v < v1; ++v)
+          for (long u = u0; u < u1; ++u) {
+            auto x = o.xu * u + o.xv * v + o.x0;
+            auto y = o.yu * u + o.yv * v + o.y0;
+            add_pixel(sum, pixels.data() + y * stride + x * layout.bpp, layout);
+          }
+
+        unsigned long n = (u1 - u0) * (v1 - v0);
+        for (auto c : sum)
+          *out++ = (c + n / 2) / n;
+      }
+    }
+
+    return encode(rgb, pixel_width, pixel_height, key);
   }
 
   int device_type::register_image(Magick::Image&& image)
@@ -99,7 +560,83 @@ namespace streamdeck {
 
   int device_type::register_image(const char* fname)
   {
-    return register_image(Magick::Image(fname));
+    return register_image(decode(fname));
+  }
+
+  int device_type::replace_image(int handle, Magick::Image&& image)
+  {
+    if (handle < 0 || size_t(handle) >= registered.size())
+      return -1;
+    unsigned width = image.columns();
+    unsigned height = image.rows();
+    registered[handle] = registered_type(width, height, reformat(std::move(image)));
+    return handle;
+  }
+
+  int device_type::replace_image(int handle, const char* fname)
+  {
+    return replace_image(handle, decode(fname));
+  }
+
+  int device_type::register_image(std::span<const std::byte> pixels, unsigned width, unsigned height, size_t stride, pixel_format fmt)
+  {
+    if (! valid_pixels(pixels, width, height, stride, fmt))
+      return -1;
+    auto data(reformat(pixels, width, height, stride, fmt));
+    registered.emplace_back(width, height, Magick::Blob(data.data(), data.size()));
+    return registered.size() - 1;
+  }
+
+  device_type::handle_range device_type::add_registered(std::vector<registered_type>&& images)
+  {
+    int first = registered.size();
+    std::ranges::move(images, std::back_inserter(registered));
+    return handle_range(first, int(registered.size()));
+  }
+
+  device_type::handle_range device_type::register_sprite_sheet(Magick::Image&& sheet, unsigned cols, unsigned rows)
+  {
+    auto tile_width = cols == 0 ? 0 : sheet.columns() / cols;
+    auto tile_height = rows == 0 ? 0 : sheet.rows() / rows;
+    if (tile_width == 0 || tile_height == 0)
+      return add_registered({});
+
+    // The tiles share the pixels of the sheet until cropped.
+    std::vector<registered_type> res(cols * rows);
+    parallel_for(res.size(), [&](size_t i) {
+      Magick::Image tile(sheet);
+      tile.crop(Magick::Geometry(tile_width, tile_height, (i % cols) * tile_width, (i / cols) * tile_height));
+      tile.repage();
+      res[i] = registered_type(tile_width, tile_height, reformat(std::move(tile)));
+    });
+    return add_registered(std::move(res));
+  }
+
+  device_type::handle_range device_type::register_sprite_sheet(const char* fname, unsigned cols, unsigned rows)
+  {
+    return register_sprite_sheet(decode(fname), cols, rows);
+  }
+
+  device_type::handle_range device_type::register_images(std::span<const std::filesystem::path> fnames)
+  {
+    std::vector<registered_type> res(fnames.size());
+    parallel_for(res.size(), [&](size_t i) {
+      auto image(decode(fnames[i].c_str()));
+      unsigned width = image.columns();
+      unsigned height = image.rows();
+      res[i] = registered_type(width, height, reformat(std::move(image)));
+    });
+    return add_registered(std::move(res));
+  }
+
+  device_type::handle_range device_type::register_directory(const std::filesystem::path& dir)
+  {
+    std::vector<std::filesystem::path> fnames;
+    for (const auto& e : std::filesystem::directory_iterator(dir))
+      if (e.is_regular_file() && is_image_file(e.path()))
+        fnames.emplace_back(e.path());
+    std::ranges::sort(fnames);
+    return register_images(fnames);
   }
 
   template<typename C>
@@ -117,6 +654,7 @@ namespace streamdeck {
 
       std::fill(destit, buffer.end(), std::byte(0));
 
+      trace_span span("hid_write", "usb", trace_id, key, page);
       if (auto r = write(buffer); r < 0)
         return r;
     }
@@ -126,13 +664,13 @@ namespace streamdeck {
 
   int device_type::set_key_image(unsigned key, Magick::Image&& image)
   {
-    auto blob(reformat(std::move(image)));
+    auto blob(reformat(std::move(image), key));
     return set_key_image(key, blob_container(blob));
   }
 
   int device_type::set_key_image(unsigned key, const char* fname)
   {
-    return set_key_image(key, Magick::Image(fname));
+    return set_key_image(key, decode(fname, key));
   }
 
   int device_type::set_key_image(unsigned key, int handle)
@@ -140,6 +678,13 @@ namespace streamdeck {
     return set_key_image(key, blob_container(std::get<Magick::Blob>(registered[handle])));
   }
 
+  int device_type::set_key_image(unsigned key, std::span<const std::byte> pixels, unsigned width, unsigned height, size_t stride, pixel_format fmt)
+  {
+    if (! valid_pixels(pixels, width, height, stride, fmt))
+      return -1;
+    return set_key_image(key, reformat(pixels, width, height, stride, fmt, key));
+  }
+
 
   int device_type::set_touch_image(unsigned offset, Magick::Image&& image)
   {
@@ -148,7 +693,7 @@ namespace streamdeck {
 
   int device_type::set_touch_image(unsigned offset, const char* fname)
   {
-    return set_touch_image(offset, Magick::Image(fname));
+    return set_touch_image(offset, decode(fname));
   }
 
   int device_type::set_touch_image(unsigned offset, int handle)
@@ -235,6 +780,7 @@ namespace streamdeck {
       }
 
       int set_touch_image(unsigned offset, Magick::Image&& image) override;
+      int set_touch_image(unsigned offset, std::span<const std::byte> pixels, unsigned width, unsigned height, size_t stride, pixel_format fmt);
       int set_touch_image(unsigned offset, int handle) override;
 
     private:
@@ -262,8 +808,15 @@ namespace streamdeck {
     {
       std::vector<bool> res(key_count);
       std::vector<std::byte> state(1 + key_count);
-      auto n = base_type::read(state);
+      int n;
+      do {
+        trace_span span("hid_read", "input", trace_id);
+        n = base_type::read(state);
+        if (n < 0)
+          throw std::runtime_error("cannot read from device");
+      } while (n < 1);
       std::transform(state.begin() + 1, state.begin() + n, res.begin(), [](auto v) { return v != std::byte(0); });
+      publish_key_state(res);
       return res;
     }
 
@@ -271,28 +824,41 @@ namespace streamdeck {
     {
       std::vector<bool> res(key_count);
       std::vector<std::byte> state(1 + key_count);
-      auto n = base_type::read(state, timeout);
-      if (n == 0)
+      int n;
+      {
+        trace_span span("hid_read", "input", trace_id);
+        n = base_type::read(state, timeout);
+        // Only record wakeups, not the idle timeouts of polling readers.
+        if (n == 0)
+          span.discard();
+      }
+      if (n < 0)
+        throw std::runtime_error("cannot read from device");
+      if (n < 1)
         return std::nullopt;
       std::transform(state.begin() + 1, state.begin() + n, res.begin(), [](auto v) { return v != std::byte(0); });
+      publish_key_state(res);
       return res;
     }
 
     void gen1_device_type::reset()
     {
       const std::array<std::byte, 17> req{std::byte(0x0b), std::byte(0x63)};
+      trace_span span("feature_report", "usb", trace_id);
       send_report(req);
     }
 
     void gen1_device_type::_set_brightness(std::byte p)
     {
       const std::array<std::byte, 17> req{std::byte(0x05), std::byte(0x55), std::byte(0xaa), std::byte(0xd1), std::byte(0x01), p};
+      trace_span span("feature_report", "usb", trace_id);
       send_report(req);
     }
 
     std::string gen1_device_type::_get_string(std::byte cmd)
     {
       std::array<std::byte, 17> buf{cmd};
+      trace_span span("feature_report", "usb", trace_id);
       auto len = get_report(buf);
       return len > 5 ? std::string(reinterpret_cast<const char*>(buf.data()) + 5) : "";
     }
@@ -333,9 +899,14 @@ namespace streamdeck {
       std::vector<bool> res(key_count);
       std::vector<std::byte> state(4 + key_count);
       int n;
-      while ((n = base_type::read(state)) < 4)
-        continue;
+      do {
+        trace_span span("hid_read", "input", trace_id);
+        n = base_type::read(state);
+        if (n < 0)
+          throw std::runtime_error("cannot read from device");
+      } while (n < 4);
       std::transform(state.begin() + 4, state.begin() + n, res.begin(), [](auto v) { return v != std::byte(0); });
+      publish_key_state(res);
       return res;
     }
 
@@ -343,28 +914,42 @@ namespace streamdeck {
     {
       std::vector<bool> res(key_count);
       std::vector<std::byte> state(4 + key_count);
-      auto n = base_type::read(state, timeout);
-      if (n == 0)
+      int n;
+      {
+        trace_span span("hid_read", "input", trace_id);
+        n = base_type::read(state, timeout);
+        // Only record wakeups, not the idle timeouts of polling readers.
+        if (n == 0)
+          span.discard();
+      }
+      if (n < 0)
+        throw std::runtime_error("cannot read from device");
+      // A short report carries no key state.
+      if (n < 4)
         return std::nullopt;
       std::transform(state.begin() + 4, state.begin() + n, res.begin(), [](auto v) { return v != std::byte(0); });
+      publish_key_state(res);
       return res;
     }
 
     void gen2_device_type::reset()
     {
       const std::array<std::byte, 32> req{std::byte(0x03), std::byte(0x02)};
+      trace_span span("feature_report", "usb", trace_id);
       send_report(req);
     }
 
     void gen2_device_type::_set_brightness(std::byte p)
     {
       const std::array<std::byte, 32> req{std::byte(0x03), std::byte(0x08), p};
+      trace_span span("feature_report", "usb", trace_id);
       send_report(req);
     }
 
     std::string gen2_device_type::_get_string(std::byte cmd, size_t off)
     {
       std::array<std::byte, 32> buf{cmd};
+      trace_span span("feature_report", "usb", trace_id);
       auto len = get_report(buf);
       return len >= 0 && size_t(len) > off ? std::string(reinterpret_cast<const char*>(buf.data()) + off) : "";
     }
@@ -417,6 +1002,7 @@ namespace streamdeck {
         while (srcit != data.end() && destit != buffer.end())
           *destit++ = std::byte(*srcit++);
 
+        trace_span span("hid_write", "usb", trace_id, -1, page, offset);
         if (auto r = write(buffer); r < 0)
           return r;
       }
@@ -430,6 +1016,14 @@ namespace streamdeck {
       return set_touch_image(offset, image.columns(), image.rows(), blob_container(blob));
     }
 
+    int plus_device_type::set_touch_image(unsigned offset, std::span<const std::byte> pixels, unsigned width, unsigned height, size_t stride, pixel_format fmt)
+    {
+      if (! valid_pixels(pixels, width, height, stride, fmt))
+        return -1;
+      auto data(encode(to_rgb(pixels, width, height, stride, fmt), width, height));
+      return set_touch_image(offset, width, height, data);
+    }
+
     int plus_device_type::set_touch_image(unsigned offset, int handle)
     {
       auto& blob = registered[handle];
@@ -516,6 +1110,15 @@ constexpr std::array products{
 
   } // anonymous namespace
 
+  // Not virtual to keep the layout of the virtual function table.  Only the Plus devices have
+  // a touch screen.
+  int device_type::set_touch_image(unsigned offset, std::span<const std::byte> pixels, unsigned width, unsigned height, size_t stride, pixel_format fmt)
+  {
+    if (auto plus = dynamic_cast<plus_device_type*>(this); plus != nullptr)
+      return plus->set_touch_image(offset, pixels, width, height, stride, fmt);
+    return -1;
+  }
+
   context::context()
   {
     if (auto r = hid_init(); r < 0)
@@ -529,6 +1132,58 @@ constexpr std::array products{
     Magick::InitializeMagick(nullptr);
   }
 
+  void context::trace_start(size_t capacity)
+  {
+    trace_stop();
+
+    // The serial numbers are read only once.  Spans of other threads can still use trace_id
+    // after tracing is stopped.  The store of enabled below publishes the strings.
+    {
+      static std::mutex serial_lock;
+      std::lock_guard guard(serial_lock);
+      for (auto& dev : devinfo)
+        if (dev->connected() && ! dev->m_trace_id_set) {
+          dev->trace_id = dev->get_serial_number();
+          dev->m_trace_id_set = true;
+        }
+    }
+
+    std::lock_guard guard(tracer.lock);
+    tracer.ring.assign(std::max<size_t>(capacity, 1), trace_event{});
+    tracer.total = 0;
+    tracer.epoch = std::chrono::steady_clock::now();
+    tracer.enabled.store(true, std::memory_order_release);
+  }
+
+  void context::trace_stop()
+  {
+    std::lock_guard guard(tracer.lock);
+    tracer.enabled = false;
+  }
+
+  void context::trace_write(std::ostream& os)
+  {
+    using usec = std::chrono::duration<double, std::micro>;
+
+    std::lock_guard guard(tracer.lock);
+    auto pid = getpid();
+    os << "{\"traceEvents\":[";
+    auto n = std::min(tracer.total, tracer.ring.size());
+    for (auto i = tracer.total - n; i < tracer.total; ++i) {
+      const auto& ev = tracer.ring[i % tracer.ring.size()];
+      os << (i == tracer.total - n ? "\n" : ",\n");
+      os << std::format(R"({{"name":"{}","cat":"{}","ph":"X","ts":{:.3f},"dur":{:.3f},"pid":{},"tid":{},"args":{{"serial":"{}")", ev.name, ev.cat, usec(ev.start - tracer.epoch).count(), usec(ev.dur).count(), pid, ev.tid, ev.id);
+      if (ev.key >= 0)
+        os << std::format(R"(,"key":{})", ev.key);
+      if (ev.page >= 0)
+        os << std::format(R"(,"page":{})", ev.page);
+      if (ev.offset >= 0)
+        os << std::format(R"(,"offset":{})", ev.offset);
+      os << "}}";
+    }
+    os << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  }
+
   context::~context()
   {
     devinfo.clear();
@@ -1,11 +1,18 @@
 #ifndef _STREAMDECKPP_HH
 # define _STREAMDECKPP_HH 1
 
+# include <array>
+# include <atomic>
 # include <cassert>
 # include <cstdint>
 # include <cstdlib>
+# include <filesystem>
+# include <iosfwd>
 # include <memory>
 # include <optional>
+# include <ranges>
+# include <span>
+# include <string>
 # include <vector>
 # include <version>
 # include <experimental/array>
@@ -36,6 +43,7 @@ namespace streamdeck {
 
   struct device_type {
     enum struct image_format_type { bmp, jpeg };
+    enum struct pixel_format { rgb, bgr, rgba, bgra };
 
     device_type(const char* path, unsigned width, unsigned height, unsigned cols, unsigned rows, image_format_type imgfmt, unsigned imgreplen, bool hflip, bool vflip, unsigned rotate);
 
@@ -64,6 +72,19 @@ namespace streamdeck {
     int register_image(Magick::Image&& image);
     int register_image(const Magick::Image& image) { return register_image(Magick::Image(image)); }
     int register_image(const char* fname);
+    int register_image(std::span<const std::byte> pixels, unsigned width, unsigned height, size_t stride, pixel_format fmt);
+
+    // Replace the image registered under HANDLE.  The result is HANDLE or -1 if it is not valid.
+    int replace_image(int handle, Magick::Image&& image);
+    int replace_image(int handle, const char* fname);
+
+    // Bulk registration.  The returned handles are consecutive.  The images are decoded and
+    // encoded in parallel.
+    using handle_range = std::ranges::iota_view<int, int>;
+    handle_range register_sprite_sheet(Magick::Image&& sheet, unsigned cols, unsigned rows);
+    handle_range register_sprite_sheet(const char* fname, unsigned cols, unsigned rows);
+    handle_range register_images(std::span<const std::filesystem::path> fnames);
+    handle_range register_directory(const std::filesystem::path& dir);
 
     int set_key_image(unsigned key, Magick::Image&& image);
     int set_key_image(unsigned row, unsigned col, Magick::Image&& image) { return set_key_image(row * key_cols + col, std::move(image)); }
@@ -71,21 +92,44 @@ namespace streamdeck {
     int set_key_image(unsigned key, const char* fname);
     int set_key_image(unsigned row, unsigned col, const char* fname) { return set_key_image(row * key_cols + col, fname); }
 
+    // Raw pixels provided by the caller, STRIDE bytes per row.  The pixels are transformed and
+    // encoded directly, without creating a Magick::Image.
+    int set_key_image(unsigned key, std::span<const std::byte> pixels, unsigned width, unsigned height, size_t stride, pixel_format fmt);
+
     int set_key_image(unsigned key, int handle);
     int set_key_image(unsigned row, unsigned col, int handle) { return set_key_image(row * key_cols + col, handle); }
 
     virtual int set_touch_image(unsigned offset, Magick::Image&& image);
     int set_touch_image(unsigned offset, const Magick::Image& image) { return set_touch_image(offset, Magick::Image(image)); }
     int set_touch_image(unsigned offset, const char* fname);
+    int set_touch_image(unsigned offset, std::span<const std::byte> pixels, unsigned width, unsigned height, size_t stride, pixel_format fmt);
 
     virtual int set_touch_image(unsigned offset, int handle);
 
     virtual payload_type::iterator add_header(payload_type& buffer, unsigned key, unsigned remaining, unsigned page) = 0;
 
+    // Errors, e.g., when the device is unplugged, are reported with a std::runtime_error exception.
     virtual std::vector<bool> read() = 0;
 
     virtual std::optional<std::vector<bool>> read(int timeout) = 0;
 
+    // The key state decoded by the last read is published for all threads.  These functions
+    // neither lock nor allocate.  The sequence number counts the updates.
+    static constexpr unsigned max_keys = 64;
+    struct key_snapshot {
+      uint64_t sequence;
+      uint64_t pressed;
+    };
+    key_snapshot key_state() const;
+    bool key_pressed(unsigned key) const { return key < max_keys && (m_key_pressed.load(std::memory_order_acquire) & (uint64_t(1) << key)) != 0; }
+    uint64_t key_sequence() const { return m_key_seq.load(std::memory_order_acquire) / 2; }
+    // Bit mask of the keys which changed in the updates after SEQUENCE.
+    uint64_t changed_since(uint64_t sequence) const;
+    // Called by read.  Public so that input can be simulated, e.g., for a device object created
+    // with a null path which does not use any hardware.
+    void publish_key_state(const std::vector<bool>& state);
+    void publish_key_state(uint64_t pressed);
+
     virtual void reset() = 0;
 
     virtual std::string get_serial_number() = 0;
@@ -154,14 +198,36 @@ namespace streamdeck {
     int set_key_image(unsigned key, const C& data);
 
   protected:
-    Magick::Blob create_blob(Magick::Image&& image);
-    Magick::Blob reformat(Magick::Image&& image);
+    Magick::Image decode(const char* fname, int key = -1);
+    Magick::Blob create_blob(Magick::Image&& image, int key = -1);
+    Magick::Blob reformat(Magick::Image&& image, int key = -1);
+    payload_type reformat(std::span<const std::byte> pixels, unsigned width, unsigned height, size_t stride, pixel_format fmt, int key = -1);
+    payload_type encode(const std::vector<unsigned char>& rgb, unsigned width, unsigned height, int key = -1);
 
-    std::vector<std::tuple<unsigned, unsigned, Magick::Blob>> registered;
+    using registered_type = std::tuple<unsigned, unsigned, Magick::Blob>;
+    std::vector<registered_type> registered;
+
+    handle_range add_registered(std::vector<registered_type>&& images);
 
   private:
+    friend struct context;
+
     const char* const m_path;
     hid_device* const m_d;
+
+    // Seqlock for the key state: twice the number of updates, odd while an update is in progress.
+    std::atomic<uint64_t> m_key_seq = 0;
+    std::atomic<uint64_t> m_key_pressed = 0;
+    // Sequence number of the last change of each key.
+    std::array<std::atomic<uint64_t>, max_keys> m_key_changed{};
+
+  protected:
+    // Serial number used to tag trace events.  It is set when tracing starts for the first time
+    // and never changed afterwards since spans read it without locking.
+    std::string trace_id;
+
+  private:
+    bool m_trace_id_set = false;
   };
 
   struct context {
@@ -174,11 +240,88 @@ namespace streamdeck {
     auto end() { return devinfo.end(); }
     auto& operator[](size_t n) { return devinfo[n]; }
 
+    // Record trace events for the image and input pipelines of all devices in a ring buffer
+    // of CAPACITY entries.  The events are written in the Chrome trace event format which can
+    // be loaded in chrome://tracing or Perfetto.
+    void trace_start(size_t capacity = 65536);
+    void trace_stop();
+    void trace_write(std::ostream& os);
+
   private:
     hid_device_info* devs = nullptr;
     std::vector<std::unique_ptr<device_type>> devinfo;
   };
 
+
+  // The HID library opens the devices exclusively.  The broker owns the devices of a context
+  // and shares them with other processes which connect to a Unix domain socket.  Each client
+  // claims a set of keys of a device.  The key images are exchanged through framebuffers in
+  // shared memory and the key state through a ring buffer in the same memory.
+  //
+  // The key ownership is advisory.  Every client maps the shared memory of the whole device and
+  // could write the framebuffers of other clients.  The broker only uploads images of claimed
+  // keys and does not trust anything in the shared memory, so a misbehaving client cannot harm
+  // the broker, but it is not prevented from interfering with clients of the same device.
+  struct broker {
+    broker(context& ctx, const char* path);
+    ~broker();
+
+    static std::string default_path();
+
+    // Handle client requests until stop is called.
+    void run();
+    void stop();
+
+  private:
+    struct deck;
+
+    void release(size_t d, uint64_t keys);
+
+    const std::string m_path;
+    int m_fd = -1;
+    int m_stopfd = -1;
+    std::atomic<bool> m_done = false;
+    std::vector<std::unique_ptr<deck>> m_decks;
+  };
+
+
+  struct broker_client {
+    // Claim KEYS, a bit mask, of the device with serial number SERIAL.  With an empty SERIAL the
+    // first device is used.
+    broker_client(const char* path, const std::string& serial, uint64_t keys);
+    broker_client(const broker_client&) = delete;
+    broker_client& operator=(const broker_client&) = delete;
+    ~broker_client();
+
+    unsigned key_count() const { return m_key_count; }
+    unsigned pixel_width() const { return m_pixel_width; }
+    unsigned pixel_height() const { return m_pixel_height; }
+
+    // The framebuffer of a key contains pixel_width * pixel_height pixels in BGRA format, without
+    // padding.  After the image is complete it has to be committed.  The broker uploads all
+    // committed images in one batch.  framebuffer waits until the previously committed image of
+    // the key is uploaded; the memory must not be written after commit until framebuffer is
+    // called again.
+    std::span<std::byte> framebuffer(unsigned key);
+    void commit(unsigned key);
+
+    // Wait for a change of the state of the claimed keys.  The result is a bit mask of the
+    // pressed keys.  With a non-negative TIMEOUT, in milliseconds, nothing is returned if no
+    // change happened.
+    std::optional<uint64_t> read(int timeout = -1);
+
+  private:
+    int m_fd = -1;
+    void* m_mem = nullptr;
+    size_t m_size = 0;
+    uint64_t m_keys;
+    unsigned m_key_count = 0;
+    unsigned m_pixel_width = 0;
+    unsigned m_pixel_height = 0;
+    uint64_t m_tail = 0;
+    uint64_t m_last = 0;
+  };
+
 } // namespace streamdeck
 
 #endif // streamdeckpp.hh
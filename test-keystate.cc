@@ -0,0 +1,107 @@
+// Stress test for the lock-free key state.  A simulated device without hardware publishes
+// key states derived from the sequence number while several threads read them.
+#include "streamdeckpp.hh"
+
+#include <atomic>
+#include <cstdlib>
+#include <print>
+#include <thread>
+#include <vector>
+
+
+namespace {
+
+  constexpr unsigned ncols = 8;
+  constexpr unsigned nrows = 4;
+  constexpr uint64_t nupdates = 500000;
+  constexpr unsigned nreaders = 4;
+
+
+  // The key state published as update number SEQ.
+  uint64_t pattern(uint64_t seq)
+  {
+    if (seq == 0)
+      return 0;
+    return ((seq * 0x9e3779b97f4a7c15ull) >> 20) & ((uint64_t(1) << (ncols * nrows)) - 1);
+  }
+
+
+  struct simulated_device_type final : streamdeck::device_type {
+    simulated_device_type() : device_type(nullptr, 72, 72, ncols, nrows, image_format_type::jpeg, 1024, false, false, 0) { }
+
+    payload_type::iterator add_header(payload_type& buffer, unsigned, unsigned, unsigned) override { return buffer.begin(); }
+    std::vector<bool> read() override { return std::vector<bool>(key_count); }
+    std::optional<std::vector<bool>> read(int) override { return std::nullopt; }
+    void reset() override { }
+    std::string get_serial_number() override { return "simulated"; }
+    std::string get_firmware_version() override { return "0"; }
+
+  private:
+    void _set_brightness(std::byte) override { }
+  };
+
+} // anonymous namespace
+
+
+int main()
+{
+  simulated_device_type dev;
+  if (dev.connected()) {
+    std::println("simulated device must not be connected");
+    return 1;
+  }
+
+  std::atomic<bool> done = false;
+  std::atomic<uint64_t> failures = 0;
+  std::atomic<uint64_t> checks = 0;
+
+  std::vector<std::thread> readers;
+  for (unsigned t = 0; t < nreaders; ++t)
+    readers.emplace_back([&dev, &done, &failures, &checks] {
+      uint64_t last = 0;
+      uint64_t nchecks = 0;
+      uint64_t nfailures = 0;
+      while (! done.load(std::memory_order_relaxed)) {
+        auto st = dev.key_state();
+        // The sequence number never goes backward and the bits match it.
+        if (st.sequence < last || st.pressed != pattern(st.sequence))
+          ++nfailures;
+        last = st.sequence;
+
+        for (unsigned k = 0; k < dev.key_count; ++k)
+          (void) dev.key_pressed(k);
+
+        if (st.sequence > 0) {
+          auto changed = dev.changed_since(st.sequence - 1);
+          // Only compare if no update happened in between.
+          if (dev.key_sequence() == st.sequence && changed != (pattern(st.sequence) ^ pattern(st.sequence - 1)))
+            ++nfailures;
+        }
+        ++nchecks;
+      }
+      checks += nchecks;
+      failures += nfailures;
+    });
+
+  // Alternate between the two interfaces.
+  for (uint64_t seq = 1; seq <= nupdates; ++seq)
+    if (seq % 2 == 0)
+      dev.publish_key_state(pattern(seq));
+    else {
+      std::vector<bool> state(dev.key_count);
+      for (unsigned k = 0; k < dev.key_count; ++k)
+        state[k] = (pattern(seq) & (uint64_t(1) << k)) != 0;
+      dev.publish_key_state(state);
+    }
+
+  done = true;
+  for (auto& r : readers)
+    r.join();
+
+  auto st = dev.key_state();
+  if (st.sequence != nupdates || st.pressed != pattern(nupdates))
+    ++failures;
+
+  std::println("{} updates, {} checks, {} failures", st.sequence, checks.load(), failures.load());
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}